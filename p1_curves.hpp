@@ -0,0 +1,846 @@
+// Curve kernels shared by the viewer (p1_source.cpp), the batch tessellator (p1_tess.cpp) and
+// other tools that sample the curves (prepare_curve_queries / query_curves).
+// Standard library only, no GL. Exactly one translation unit of a program defines
+// P1_CURVES_IMPLEMENTATION before including this file, the others only get the declarations.
+#ifndef P1_CURVES_HPP
+#define P1_CURVES_HPP
+
+#include <stdio.h>
+#include <vector>
+#include <functional>
+
+typedef struct Vertex {
+	float Position[4];
+	float Color[4];
+	void SetCoords(float *coords) {
+		Position[0] = coords[0];
+		Position[1] = coords[1];
+		Position[2] = coords[2];
+		Position[3] = coords[3];
+	}
+	void SetColor(float *color) {
+		Color[0] = color[0];
+		Color[1] = color[1];
+		Color[2] = color[2];
+		Color[3] = color[3];
+	}
+};
+
+// ATTN: use POINT structs for cleaner code (POINT is a part of a vertex)
+// allows for (1-t)*P_1+t*P_2  avoiding repeat for each coordinate (x,y,z)
+typedef struct point {
+	float x, y, z;
+	point(const float x = 0, const float y = 0, const float z = 0) : x(x), y(y), z(z){};
+	point(float *coords) : x(coords[0]), y(coords[1]), z(coords[2]){};
+	point operator -(const point& a) const {
+		return point(x - a.x, y - a.y, z - a.z);
+	}
+	point operator +(const point& a) const {
+		return point(x + a.x, y + a.y, z + a.z);
+	}
+	point operator *(const float& a) const {
+		return point(x * a, y * a, z * a);
+	}
+	point operator /(const float& a) const {
+		return point(x / a, y / a, z / a);
+	}
+	
+	float* toArray() {
+		float array[] = { x, y, z, 1.0f };
+		return array;
+	}
+};
+
+// Forward differencing: re-evaluate the difference table from the exact polynomial
+// every FD_REANCHOR samples so float round-off cannot pile up on long runs
+const int FD_REANCHOR = 64;
+extern thread_local float fdMaxDrift;	// largest drift seen at a re-anchor, for checking
+
+// Subdivision levels of at least PARALLEL_SUBDIVISION_MIN points are split into tiles of
+// SUBDIVISION_TILE input points (~48 KB in, ~96 KB out) and spread over the worker pool
+const int PARALLEL_SUBDIVISION_MIN = 32768;
+const int SUBDIVISION_TILE = 4096;
+
+// Least-squares fitting: FIT_ITERATIONS rounds of solve + parameter correction per fit, with
+// FIT_NEWTON_STEPS foot point steps per sample and round and the tangential error weighted down
+// to FIT_TANGENT_WEIGHT after the first round
+const int FIT_ITERATIONS = 8;
+const int FIT_NEWTON_STEPS = 2;
+const double FIT_TANGENT_WEIGHT = 0.001;
+
+// Batch parametric queries run in blocks of QUERY_BLOCK lanes (gather, then one branch-free
+// pass per block); batches of at least PARALLEL_QUERY_MIN are split into tiles of QUERY_TILE
+// queries and spread over the worker pool
+const int QUERY_BLOCK = 256;
+const int PARALLEL_QUERY_MIN = 65536;
+const int QUERY_TILE = 16384;
+
+// Schemes of tessellate_curve; param is the subdivision depth or the samples per segment
+enum { TESS_BSPLINE = 0, TESS_CATMULL_ROM = 1, TESS_BEZIER = 2 };
+
+int sample_cubic_forward_diff(point, point, point, point, int, Vertex*, float*);
+int subdivide_level(const point*, int, bool, point*);
+void subdivide_tile(const point*, int, bool, point*, int, int);
+void parallel_for(int, const std::function<void(int)>&);
+void stop_workers(void);
+void catmull_rom_segment(const point*, int, bool, int, point*);
+void bspline_segment(const point*, int, bool, int, point*);
+int tessellated_count(int, bool, int, int);
+void tessellate_curve(const point*, int, bool, int, int, std::vector<point>*, Vertex*, float*);
+void read_curves(FILE*, std::vector<point>&, std::vector<int>&, std::vector<char>&);
+int bspline_weights(int, bool, float, int*, float*, float*, float*);
+float fit_bspline(const point*, int, bool, int, std::vector<point>&);
+float fit_bspline_tolerance(const point*, int, bool, float, std::vector<point>&);
+
+// Curves prepared for query_curves: the Bezier points of every segment, so a query is one lookup
+typedef struct CurveQuerySet {
+	std::vector<float> bezier;		// 4 points x, y, z per segment, segments of all curves back to back
+	std::vector<int> segmentFirst;	// first segment of every curve, plus the total at the end
+	int numCurves() const {
+		return (int)segmentFirst.size() - 1;
+	}
+	int numSegments(int c) const {
+		return segmentFirst[c + 1] - segmentFirst[c];
+	}
+};
+
+// Structure-of-arrays answers, entry i for query i. Arrays left NULL are not computed into.
+typedef struct CurveQueryResult {
+	float* position[3];
+	float* d1[3];		// first derivative in t
+	float* d2[3];		// second derivative in t
+	float* curvature;
+};
+
+void prepare_curve_queries(const point*, const int*, const char*, int, int, CurveQuerySet&);
+int query_curves(const CurveQuerySet&, const int*, const int*, const float*, int, const CurveQueryResult&);
+
+#endif
+
+#ifdef P1_CURVES_IMPLEMENTATION
+#undef P1_CURVES_IMPLEMENTATION
+
+#include <math.h>
+#include <float.h>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+
+thread_local float fdMaxDrift = 0.0f;
+
+// Worker pool for data-parallel kernels, started on first use. Tasks are handed out through
+// poolNext; parallel_for returns when every task of its generation ran and no worker is busy.
+std::vector<std::thread> workers;
+std::mutex poolMutex;
+std::condition_variable poolWake, poolDone;
+const std::function<void(int)>* poolTask = NULL;
+std::atomic<int> poolNext(0);
+std::atomic<bool> poolInUse(false);
+int poolTotal = 0;
+int poolRemaining = 0;
+int poolBusy = 0;
+unsigned poolGeneration = 0;
+bool poolStop = false;
+
+// Samples the cubic Bezier p0..p3 at t = k/n, k = 0..n, into out[0..n] and returns n + 1.
+// The difference table is set up once so every sample after the first is three vector adds.
+// Every FD_REANCHOR samples the table is rebuilt from the exact polynomial in double precision.
+int sample_cubic_forward_diff(point p0, point p1, point p2, point p3, int n, Vertex* out, float* color) {
+	// power basis: f(t) = a t^3 + b t^2 + c t + d
+	double a[3], b[3], c[3], d[3];
+	float P0[3] = { p0.x, p0.y, p0.z }, P1[3] = { p1.x, p1.y, p1.z };
+	float P2[3] = { p2.x, p2.y, p2.z }, P3[3] = { p3.x, p3.y, p3.z };
+	for (int j = 0; j < 3; j++) {
+		a[j] = -P0[j] + 3.0 * P1[j] - 3.0 * P2[j] + P3[j];
+		b[j] = 3.0 * P0[j] - 6.0 * P1[j] + 3.0 * P2[j];
+		c[j] = -3.0 * P0[j] + 3.0 * P1[j];
+		d[j] = P0[j];
+	}
+	const double h = 1.0 / n;
+
+	float f[3], d1[3], d2[3], d3[3];
+	for (int k = 0; k <= n; k++) {
+		if (k % FD_REANCHOR == 0) {
+			// exact value and forward differences at t = k h
+			double t = k * h;
+			for (int j = 0; j < 3; j++) {
+				float exact = (float)(((a[j] * t + b[j]) * t + c[j]) * t + d[j]);
+				if (k > 0 && fabsf(f[j] - exact) > fdMaxDrift) {
+					fdMaxDrift = fabsf(f[j] - exact);
+				}
+				f[j] = exact;
+				d1[j] = (float)(a[j] * (3 * t * t * h + 3 * t * h * h + h * h * h) + b[j] * (2 * t * h + h * h) + c[j] * h);
+				d2[j] = (float)(6 * a[j] * (t * h * h + h * h * h) + 2 * b[j] * h * h);
+				d3[j] = (float)(6 * a[j] * h * h * h);
+			}
+		}
+
+		out[k] = { { f[0], f[1], f[2], 1.0f }, { color[0], color[1], color[2], color[3] } };
+
+		f[0] += d1[0]; f[1] += d1[1]; f[2] += d1[2];
+		d1[0] += d2[0]; d1[1] += d2[1]; d1[2] += d2[2];
+		d2[0] += d3[0]; d2[1] += d3[1]; d2[2] += d3[2];
+	}
+	return n + 1;
+}
+
+// One level of the 4-point B-spline mask on in[0..n): edge points average their two parents,
+// vertex points apply the 1-6-1 mask. Closed polygons give 2n points in the same order as
+// create_B_spline_objects (edge n-1|0 first), open ones keep their end points and give 2n - 1.
+int subdivide_level(const point* in, int n, bool closed, point* out) {
+	if (n >= PARALLEL_SUBDIVISION_MIN) {
+		int tiles = (n + SUBDIVISION_TILE - 1) / SUBDIVISION_TILE;
+		parallel_for(tiles, [&](int t) {
+			subdivide_tile(in, n, closed, out, t * SUBDIVISION_TILE, std::min(n, (t + 1) * SUBDIVISION_TILE));
+		});
+	}
+	else {
+		subdivide_tile(in, n, closed, out, 0, n);
+	}
+	return closed ? 2 * n : 2 * n - 1;
+}
+
+// Writes the children of input points [begin, end). Every output point depends only on the
+// input, so tiles are independent; the halo is the one neighbour read on each side of the
+// tile, which for closed polygons wraps around at 0 and n - 1.
+void subdivide_tile(const point* in, int n, bool closed, point* out, int begin, int end) {
+	if (closed) {
+		for (int i = begin; i < end; i++) {
+			const point& prev = in[i > 0 ? i - 1 : n - 1];
+			const point& next = in[i + 1 < n ? i + 1 : 0];
+			out[2 * i] = (prev + in[i]) / 2;
+			out[2 * i + 1] = (prev + in[i] * 6 + next) / 8;
+		}
+		return;
+	}
+	for (int i = begin; i < end; i++) {
+		if (i == 0) {
+			out[0] = in[0];
+			continue;
+		}
+		out[2 * i - 1] = (in[i - 1] + in[i]) / 2;
+		out[2 * i] = (i < n - 1) ? (in[i - 1] + in[i] * 6 + in[i + 1]) / 8 : in[i];
+	}
+}
+
+static void run_pool_tasks(void) {
+	int done = 0;
+	for (int i = poolNext++; i < poolTotal; i = poolNext++) {
+		(*poolTask)(i);
+		done++;
+	}
+	std::lock_guard<std::mutex> lock(poolMutex);
+	poolRemaining -= done;
+}
+
+static void worker_loop(void) {
+	unsigned seen = 0;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(poolMutex);
+			poolWake.wait(lock, [&] { return poolStop || poolGeneration != seen; });
+			if (poolStop) {
+				return;
+			}
+			seen = poolGeneration;
+			poolBusy++;
+		}
+		run_pool_tasks();
+		{
+			std::lock_guard<std::mutex> lock(poolMutex);
+			poolBusy--;
+		}
+		poolDone.notify_all();
+	}
+}
+
+// Runs fn(0) .. fn(count - 1) on the worker pool and the calling thread. The pool serves one
+// call at a time: a call made while it is taken (from inside a task, or from another thread)
+// runs inline, so nested kernels like subdivide_level inside a per-file task never wait on it.
+void parallel_for(int count, const std::function<void(int)>& fn) {
+	bool expected = false;
+	if (count == 1 || !poolInUse.compare_exchange_strong(expected, true)) {
+		for (int i = 0; i < count; i++) {
+			fn(i);
+		}
+		return;
+	}
+	if (workers.empty()) {
+		int numWorkers = (int)std::thread::hardware_concurrency() - 1;
+		for (int i = 0; i < numWorkers; i++) {
+			workers.push_back(std::thread(worker_loop));
+		}
+	}
+	if (workers.empty()) {
+		for (int i = 0; i < count; i++) {
+			fn(i);
+		}
+		poolInUse = false;
+		return;
+	}
+	{
+		// a worker that woke late for the previous call may still be draining it
+		std::unique_lock<std::mutex> lock(poolMutex);
+		poolDone.wait(lock, [] { return poolBusy == 0; });
+		poolTask = &fn;
+		poolTotal = count;
+		poolRemaining = count;
+		poolNext = 0;
+		poolGeneration++;
+	}
+	poolWake.notify_all();
+	run_pool_tasks();
+	{
+		std::unique_lock<std::mutex> lock(poolMutex);
+		poolDone.wait(lock, [] { return poolRemaining == 0 && poolBusy == 0; });
+	}
+	poolInUse = false;
+}
+
+void stop_workers(void) {
+	{
+		std::lock_guard<std::mutex> lock(poolMutex);
+		poolStop = true;
+	}
+	poolWake.notify_all();
+	for (size_t i = 0; i < workers.size(); i++) {
+		workers[i].join();
+	}
+	workers.clear();
+}
+
+// Bezier points b[0..3] of Catmull-Rom segment i (from p[i] to p[i+1]), the same thirds as
+// create_catmull_rom_objects; open curves repeat their end points as the missing neighbours
+void catmull_rom_segment(const point* p, int n, bool closed, int i, point* b) {
+	int i0 = closed ? (i + n - 1) % n : (i > 0 ? i - 1 : 0);
+	int i2 = closed ? (i + 1) % n : i + 1;
+	int i3 = closed ? (i + 2) % n : (i + 2 < n ? i + 2 : n - 1);
+	b[0] = p[i];
+	b[1] = p[i] + (p[i2] - p[i0]) / 6;
+	b[2] = p[i2] - (p[i3] - p[i]) / 6;
+	b[3] = p[i2];
+}
+
+// Bezier points b[0..3] of uniform cubic B-spline span i (from near p[i] to near p[i+1]). Open
+// curves behave as if mirrored phantom points 2 p0 - p1 were added at the ends, so they end on
+// their end points like the open subdivision does.
+void bspline_segment(const point* p, int n, bool closed, int i, point* b) {
+	point a = closed ? p[(i + n - 1) % n] : (i > 0 ? p[i - 1] : p[0] * 2 - p[1]);
+	point c0 = p[i];
+	point c1 = closed ? p[(i + 1) % n] : p[i + 1];
+	point d = closed ? p[(i + 2) % n] : (i + 2 < n ? p[i + 2] : p[n - 1] * 2 - p[n - 2]);
+	b[0] = (a + c0 * 4 + c1) / 6;
+	b[1] = (c0 * 2 + c1) / 3;
+	b[2] = (c0 + c1 * 2) / 3;
+	b[3] = (c0 + c1 * 4 + d) / 6;
+}
+
+// Vertices tessellate_curve writes for a curve of n control points: subdivision to depth param,
+// param Catmull-Rom samples per segment, or the Bezier points of every B-spline span. Closed
+// curves end on their first vertex again.
+int tessellated_count(int n, bool closed, int scheme, int param) {
+	if (n < 2) {
+		return 0;
+	}
+	int segments = closed ? n : n - 1;
+	if (scheme == TESS_CATMULL_ROM) {
+		return segments * param + 1;
+	}
+	if (scheme == TESS_BEZIER) {
+		return segments * 3 + 1;
+	}
+	return segments * (1 << param) + 1;
+}
+
+// Tessellates one curve into out[0..tessellated_count). scratch[0..1] hold the subdivision levels
+// and only grow, so a caller that keeps them around stops allocating.
+void tessellate_curve(const point* p, int n, bool closed, int scheme, int param, std::vector<point>* scratch, Vertex* out, float* color) {
+	int count = tessellated_count(n, closed, scheme, param);
+	int segments = closed ? n : n - 1;
+	if (count == 0) {
+		return;
+	}
+	if (scheme == TESS_CATMULL_ROM) {
+		// consecutive segments share an end point, the next segment overwrites it
+		point b[4];
+		for (int i = 0; i < segments; i++) {
+			catmull_rom_segment(p, n, closed, i, b);
+			sample_cubic_forward_diff(b[0], b[1], b[2], b[3], param, &out[i * param], color);
+		}
+		return;
+	}
+	if (scheme == TESS_BEZIER) {
+		point b[4];
+		for (int i = 0; i < segments; i++) {
+			bspline_segment(p, n, closed, i, b);
+			for (int k = 0; k < 4; k++) {
+				out[3 * i + k] = { { b[k].x, b[k].y, b[k].z, 1.0f }, { color[0], color[1], color[2], color[3] } };
+			}
+		}
+		return;
+	}
+
+	size_t size = (size_t)n << param;
+	if (scratch[0].size() < size) {
+		scratch[0].resize(size);
+		scratch[1].resize(size);
+	}
+	const point* level = p;
+	int m = n;
+	for (int d = 0; d < param; d++) {
+		point* next = scratch[d & 1].data();
+		m = subdivide_level(level, m, closed, next);
+		level = next;
+	}
+	for (int i = 0; i < count; i++) {
+		const point& q = level[i % m];
+		out[i] = { { q.x, q.y, q.z, 1.0f }, { color[0], color[1], color[2], color[3] } };
+	}
+}
+
+// Text format: "curve open" or "curve closed" starts a curve, every following "x y [z]" line
+// adds a control point to it. Lines starting with # are comments. start gets the first point
+// of every curve followed by the total.
+void read_curves(FILE* file, std::vector<point>& points, std::vector<int>& start, std::vector<char>& closed) {
+	points.clear();
+	start.assign(1, 0);
+	closed.clear();
+	char line[256], kind[32];
+	while (fgets(line, sizeof(line), file)) {
+		float x, y, z = 0.0f;
+		if (line[0] == '#') {
+			continue;
+		}
+		if (sscanf(line, "curve %31s", kind) == 1) {
+			if (closed.size() > 0) {
+				start.push_back((int)points.size());
+			}
+			closed.push_back(std::string(kind) == "closed");
+		}
+		else if (sscanf(line, "%f %f %f", &x, &y, &z) >= 2 && closed.size() > 0) {
+			points.push_back(point(x, y, z));
+		}
+	}
+	if (closed.size() > 0) {
+		start.push_back((int)points.size());
+	}
+}
+
+// Weights of the uniform cubic B-spline with m control points at u in [0, segments]: the curve
+// point is the sum of w[k] * c[idx[k]], dw and ddw give its first two derivatives. Open curves
+// fold their mirrored phantom end points into the real ones, so there can be up to 6 terms.
+int bspline_weights(int m, bool closed, float u, int* idx, float* w, float* dw, float* ddw) {
+	int segments = closed ? m : m - 1;
+	int i = std::min(std::max((int)floorf(u), 0), segments - 1);
+	float t = u - i, s = 1.0f - t;
+	float b[4] = { s * s * s / 6, (3 * t * t * t - 6 * t * t + 4) / 6, (-3 * t * t * t + 3 * t * t + 3 * t + 1) / 6, t * t * t / 6 };
+	float db[4] = { -s * s / 2, (3 * t * t - 4 * t) / 2, (-3 * t * t + 2 * t + 1) / 2, t * t / 2 };
+	float ddb[4] = { s, 3 * t - 2, 1 - 3 * t, t };
+	int count = 0;
+	for (int k = 0; k < 4; k++) {
+		int j = i - 1 + k;
+		int terms[2] = { j, -1 };
+		float scale[2] = { 1.0f, 0.0f };
+		if (closed) {
+			terms[0] = (j + m) % m;
+		}
+		else if (j < 0) {
+			terms[0] = 0, terms[1] = 1, scale[0] = 2.0f, scale[1] = -1.0f;	// 2 c0 - c1
+		}
+		else if (j >= m) {
+			terms[0] = m - 1, terms[1] = m - 2, scale[0] = 2.0f, scale[1] = -1.0f;
+		}
+		for (int e = 0; e < 2 && terms[e] >= 0; e++) {
+			idx[count] = terms[e];
+			w[count] = scale[e] * b[k];
+			dw[count] = scale[e] * db[k];
+			ddw[count] = scale[e] * ddb[k];
+			count++;
+		}
+	}
+	return count;
+}
+
+// Least-squares fit of m control points to the samples p[0..n) into out. The samples start at
+// chord-length parameters. Every round solves for the control points with conjugate gradients
+// (warm-started from the previous round), then moves every parameter to its nearest curve point
+// with Newton steps. After the first round the error along the curve tangent only counts with
+// FIT_TANGENT_WEIGHT: the next foot point absorbs it anyway, and not fighting it makes the
+// rounds converge far faster than plain point distances do. Returns the largest distance from
+// a sample to its foot point.
+float fit_bspline(const point* p, int n, bool closed, int m, std::vector<point>& out) {
+	int segments = closed ? m : m - 1;
+	std::vector<float> u(n);
+	double length = 0.0;
+	std::vector<double> chord(n + 1, 0.0);
+	for (int i = 1; i <= n; i++) {
+		if (i < n || closed) {
+			point d = p[i % n] - p[i - 1];
+			length += sqrt((double)d.x * d.x + (double)d.y * d.y + (double)d.z * d.z);
+		}
+		chord[i] = length;
+	}
+	double total = closed ? length : chord[n - 1];
+	for (int i = 0; i < n; i++) {
+		u[i] = (total > 0.0) ? (float)(segments * chord[i] / total) : (float)segments * i / n;
+	}
+	if (!closed) {
+		u[n - 1] = (float)segments;
+	}
+
+	// start from the samples nearest to each control point's parameter
+	std::vector<double> x(3 * m), x0(3 * m);
+	for (int j = 0, i = 0; j < m; j++) {
+		while (i + 1 < n && u[i + 1] <= j) {
+			i++;
+		}
+		x0[3 * j] = p[i].x;
+		x0[3 * j + 1] = p[i].y;
+		x0[3 * j + 2] = p[i].z;
+	}
+	x = x0;
+	// a small pull towards the start keeps control points without nearby samples determined
+	const double lambda = 1e-6 * n / m;
+
+	std::vector<int> idx(6 * n);
+	std::vector<float> w(6 * n), dw(6 * n), ddw(6 * n);
+	std::vector<int> terms(n);
+	std::vector<double> tangent(3 * n, 0.0);
+	double tangentWeight = 1.0;
+	std::vector<double> r(3 * m), d(3 * m), q(3 * m), rhs(3 * m);
+	// e = sample error e, less the part along the unit tangent t that does not count fully
+	auto weigh = [&](int i, double* e) {
+		const double* t = &tangent[3 * i];
+		double along = (1.0 - tangentWeight) * (e[0] * t[0] + e[1] * t[1] + e[2] * t[2]);
+		for (int a = 0; a < 3; a++) {
+			e[a] -= along * t[a];
+		}
+	};
+	// y = (A^T M A + lambda) v, A being the sample weights and M the error weighting
+	auto apply = [&](const std::vector<double>& v, std::vector<double>& y) {
+		for (int j = 0; j < 3 * m; j++) {
+			y[j] = lambda * v[j];
+		}
+		for (int i = 0; i < n; i++) {
+			double c[3] = { 0.0, 0.0, 0.0 };
+			for (int k = 0; k < terms[i]; k++) {
+				for (int a = 0; a < 3; a++) {
+					c[a] += w[6 * i + k] * v[3 * idx[6 * i + k] + a];
+				}
+			}
+			weigh(i, c);
+			for (int k = 0; k < terms[i]; k++) {
+				for (int a = 0; a < 3; a++) {
+					y[3 * idx[6 * i + k] + a] += w[6 * i + k] * c[a];
+				}
+			}
+		}
+	};
+	// curve point and first two derivatives at sample i's parameter
+	auto evaluate = [&](int i, double* c, double* c1, double* c2) {
+		for (int a = 0; a < 3; a++) {
+			c[a] = c1[a] = c2[a] = 0.0;
+		}
+		for (int k = 0; k < terms[i]; k++) {
+			for (int a = 0; a < 3; a++) {
+				double v = x[3 * idx[6 * i + k] + a];
+				c[a] += w[6 * i + k] * v;
+				c1[a] += dw[6 * i + k] * v;
+				c2[a] += ddw[6 * i + k] * v;
+			}
+		}
+	};
+
+	for (int i = 0; i < n; i++) {
+		terms[i] = bspline_weights(m, closed, u[i], &idx[6 * i], &w[6 * i], &dw[6 * i], &ddw[6 * i]);
+	}
+	for (int round = 0; round < FIT_ITERATIONS; round++) {
+		for (int j = 0; j < 3 * m; j++) {
+			rhs[j] = lambda * x0[j];
+		}
+		for (int i = 0; i < n; i++) {
+			double s[3] = { p[i].x, p[i].y, p[i].z };
+			weigh(i, s);
+			for (int k = 0; k < terms[i]; k++) {
+				for (int a = 0; a < 3; a++) {
+					rhs[3 * idx[6 * i + k] + a] += w[6 * i + k] * s[a];
+				}
+			}
+		}
+		apply(x, q);
+		double rr = 0.0, rr0;
+		for (int j = 0; j < 3 * m; j++) {
+			r[j] = rhs[j] - q[j];
+			d[j] = r[j];
+			rr += r[j] * r[j];
+		}
+		rr0 = rr;
+		for (int it = 0; it < 3 * m && rr > 1e-24 * std::max(rr0, 1.0); it++) {
+			apply(d, q);
+			double dq = 0.0;
+			for (int j = 0; j < 3 * m; j++) {
+				dq += d[j] * q[j];
+			}
+			if (dq <= 0.0) {
+				break;
+			}
+			double alpha = rr / dq, rrNext = 0.0;
+			for (int j = 0; j < 3 * m; j++) {
+				x[j] += alpha * d[j];
+				r[j] -= alpha * q[j];
+				rrNext += r[j] * r[j];
+			}
+			for (int j = 0; j < 3 * m; j++) {
+				d[j] = r[j] + (rrNext / rr) * d[j];
+			}
+			rr = rrNext;
+		}
+
+		// parameter correction: Newton steps on |C(u) - p|^2, then the tangents at the new foot points.
+		// The end samples of an open stroke stay at 0 and segments, so the curve ends where it does.
+		for (int i = 0; i < n; i++) {
+			const double s[3] = { p[i].x, p[i].y, p[i].z };
+			double c[3], c1[3], c2[3];
+			bool pinned = !closed && (i == 0 || i == n - 1);
+			for (int step = 0; step < FIT_NEWTON_STEPS && !pinned; step++) {
+				evaluate(i, c, c1, c2);
+				double num = 0.0, den = 0.0, before = 0.0;
+				for (int a = 0; a < 3; a++) {
+					num += (c[a] - s[a]) * c1[a];
+					den += c1[a] * c1[a] + (c[a] - s[a]) * c2[a];
+					before += (c[a] - s[a]) * (c[a] - s[a]);
+				}
+				if (den <= 0.0) {
+					break;
+				}
+				// at most half a span, and halved until the foot point gets closer
+				double delta = std::min(std::max(-num / den, -0.5), 0.5);
+				float start = u[i];
+				for (int halving = 0; halving < 4; halving++, delta *= 0.5) {
+					double next = start + delta;
+					u[i] = closed ? (float)(next - segments * floor(next / segments)) : (float)std::min(std::max(next, 0.0), (double)segments);
+					terms[i] = bspline_weights(m, closed, u[i], &idx[6 * i], &w[6 * i], &dw[6 * i], &ddw[6 * i]);
+					evaluate(i, c, c1, c2);
+					double after = (c[0] - s[0]) * (c[0] - s[0]) + (c[1] - s[1]) * (c[1] - s[1]) + (c[2] - s[2]) * (c[2] - s[2]);
+					if (after <= before) {
+						break;
+					}
+					u[i] = start;
+					terms[i] = bspline_weights(m, closed, u[i], &idx[6 * i], &w[6 * i], &dw[6 * i], &ddw[6 * i]);
+				}
+			}
+			evaluate(i, c, c1, c2);
+			// samples held at an open end are off the curve along the tangent, that error counts fully
+			double speed = sqrt(c1[0] * c1[0] + c1[1] * c1[1] + c1[2] * c1[2]);
+			bool atEnd = pinned || (!closed && (u[i] <= 0.0f || u[i] >= segments));
+			for (int a = 0; a < 3; a++) {
+				tangent[3 * i + a] = (speed > 0.0 && !atEnd) ? c1[a] / speed : 0.0;
+			}
+		}
+		tangentWeight = FIT_TANGENT_WEIGHT;
+	}
+
+	out.resize(m);
+	for (int j = 0; j < m; j++) {
+		out[j] = point((float)x[3 * j], (float)x[3 * j + 1], (float)x[3 * j + 2]);
+	}
+	float maxError = 0.0f;
+	for (int i = 0; i < n; i++) {
+		int k[6];
+		float wk[6], dk[6], ddk[6];
+		int count = bspline_weights(m, closed, u[i], k, wk, dk, ddk);
+		point c;
+		for (int e = 0; e < count; e++) {
+			c = c + out[k[e]] * wk[e];
+		}
+		point diff = c - p[i];
+		maxError = std::max(maxError, sqrtf(diff.x * diff.x + diff.y * diff.y + diff.z * diff.z));
+	}
+	return maxError;
+}
+
+// Fewest control points whose fit stays within tolerance of every sample: the count doubles
+// until a fit is good enough, then a bisection finds the smallest good one. Returns its error,
+// which is above tolerance only if even n control points are not good enough.
+// Strokes with fewer samples than the smallest fit (4 closed, 3 open) are not fitted: out gets
+// the samples themselves as control points and 0 is returned.
+float fit_bspline_tolerance(const point* p, int n, bool closed, float tolerance, std::vector<point>& out) {
+	int lo = closed ? 3 : 2;
+	int m = lo + 1;
+	if (n < m) {
+		out.assign(p, p + n);
+		return 0.0f;
+	}
+	std::vector<point> fit;
+	float error = fit_bspline(p, n, closed, m, fit);
+	while (error > tolerance && m < n) {
+		lo = m;
+		m = std::min(2 * m, n);
+		error = fit_bspline(p, n, closed, m, fit);
+	}
+	out = fit;
+	float best = error;
+	int hi = m;
+	while (hi - lo > 1) {
+		int mid = (lo + hi) / 2;
+		error = fit_bspline(p, n, closed, mid, fit);
+		if (error <= tolerance) {
+			hi = mid;
+			out = fit;
+			best = error;
+		}
+		else {
+			lo = mid;
+		}
+	}
+
+	// the bisection assumes the error only falls as points are added, which the foot point
+	// iteration does not guarantee: step up while the count it settled on is out of tolerance
+	while (best > tolerance && hi < n) {
+		best = fit_bspline(p, n, closed, ++hi, out);
+	}
+	return best;
+}
+
+// Prepares numCurves curves in the read_curves layout (control points back to back, start[c] the
+// first point of curve c, closed flags) for queries. Catmull-Rom curves use its pieces; any other
+// scheme the uniform cubic B-spline spans, which TESS_BEZIER only writes out. Segment i of a
+// curve runs from near p[i] to near p[i + 1]; curves with fewer than 2 points have none.
+void prepare_curve_queries(const point* p, const int* start, const char* closed, int numCurves, int scheme, CurveQuerySet& set) {
+	set.segmentFirst.resize(numCurves + 1);
+	int total = 0;
+	for (int c = 0; c < numCurves; c++) {
+		int n = start[c + 1] - start[c];
+		set.segmentFirst[c] = total;
+		total += (n < 2) ? 0 : (closed[c] ? n : n - 1);
+	}
+	set.segmentFirst[numCurves] = total;
+	set.bezier.resize(12 * (size_t)total);
+	for (int c = 0; c < numCurves; c++) {
+		int n = start[c + 1] - start[c];
+		for (int i = 0; i < set.numSegments(c); i++) {
+			point b[4];
+			if (scheme == TESS_CATMULL_ROM) {
+				catmull_rom_segment(&p[start[c]], n, closed[c] != 0, i, b);
+			}
+			else {
+				bspline_segment(&p[start[c]], n, closed[c] != 0, i, b);
+			}
+			float* out = &set.bezier[12 * (size_t)(set.segmentFirst[c] + i)];
+			for (int k = 0; k < 4; k++) {
+				out[3 * k] = b[k].x;
+				out[3 * k + 1] = b[k].y;
+				out[3 * k + 2] = b[k].z;
+			}
+		}
+	}
+}
+
+// Queries [first, first + count), count <= QUERY_BLOCK: the Bezier points are gathered into
+// lanes, then every output is one loop over all QUERY_BLOCK lanes without branches (a fixed trip
+// count the compiler vectorizes even at -O2; spare lanes evaluate zeros). Returns the invalid
+// queries, whose outputs are NaN.
+static int query_block(const CurveQuerySet& set, const int* curve, const int* segment, const float* t, int first, int count, const CurveQueryResult& out) {
+	float b[12][QUERY_BLOCK], u[QUERY_BLOCK];
+	int invalid = 0;
+	for (int l = 0; l < count; l++) {
+		int q = first + l, c = curve[q], s = segment[q];
+		if (c < 0 || c >= set.numCurves() || s < 0 || s >= set.numSegments(c)) {
+			for (int e = 0; e < 12; e++) {
+				b[e][l] = NAN;
+			}
+			invalid++;
+		}
+		else {
+			const float* src = &set.bezier[12 * (size_t)(set.segmentFirst[c] + s)];
+			for (int e = 0; e < 12; e++) {
+				b[e][l] = src[e];
+			}
+		}
+		u[l] = std::min(std::max(t[q], 0.0f), 1.0f);
+	}
+	for (int l = count; l < QUERY_BLOCK; l++) {
+		for (int e = 0; e < 12; e++) {
+			b[e][l] = 0.0f;
+		}
+		u[l] = 0.0f;
+	}
+
+	float p[3][QUERY_BLOCK], d1[3][QUERY_BLOCK], d2[3][QUERY_BLOCK];
+	for (int j = 0; j < 3; j++) {
+		const float* b0 = b[j];
+		const float* b1 = b[3 + j];
+		const float* b2 = b[6 + j];
+		const float* b3 = b[9 + j];
+		for (int l = 0; l < QUERY_BLOCK; l++) {
+			float v = u[l], s = 1.0f - v;
+			p[j][l] = s * s * s * b0[l] + 3.0f * s * s * v * b1[l] + 3.0f * s * v * v * b2[l] + v * v * v * b3[l];
+			d1[j][l] = 3.0f * (s * s * (b1[l] - b0[l]) + 2.0f * s * v * (b2[l] - b1[l]) + v * v * (b3[l] - b2[l]));
+			d2[j][l] = 6.0f * (s * (b2[l] - 2.0f * b1[l] + b0[l]) + v * (b3[l] - 2.0f * b2[l] + b1[l]));
+		}
+	}
+	for (int j = 0; j < 3; j++) {
+		if (out.position[j] != NULL) {
+			std::copy(p[j], p[j] + count, out.position[j] + first);
+		}
+		if (out.d1[j] != NULL) {
+			std::copy(d1[j], d1[j] + count, out.d1[j] + first);
+		}
+		if (out.d2[j] != NULL) {
+			std::copy(d2[j], d2[j] + count, out.d2[j] + first);
+		}
+	}
+	if (out.curvature != NULL) {
+		// |d1 x d2| / |d1|^3 taken as |u x d2| / |d1|^2, u the unit tangent, so no term goes past
+		// the square of the data's scale (|d1|^6 leaves float on ordinary radii). The square roots
+		// and the reciprocal get loops of their own, the others vectorize. Where the curve stops
+		// the reciprocal, and so k, is 0.
+		float inv[QUERY_BLOCK], c2[QUERY_BLOCK];
+		for (int l = 0; l < QUERY_BLOCK; l++) {
+			inv[l] = d1[0][l] * d1[0][l] + d1[1][l] * d1[1][l] + d1[2][l] * d1[2][l];
+		}
+		for (int l = 0; l < QUERY_BLOCK; l++) {
+			float speed = sqrtf(inv[l]);
+			inv[l] = (speed > FLT_MIN) ? 1.0f / speed : 0.0f;
+		}
+		for (int l = 0; l < QUERY_BLOCK; l++) {
+			float ux = d1[0][l] * inv[l], uy = d1[1][l] * inv[l], uz = d1[2][l] * inv[l];
+			float cx = uy * d2[2][l] - uz * d2[1][l];
+			float cy = uz * d2[0][l] - ux * d2[2][l];
+			float cz = ux * d2[1][l] - uy * d2[0][l];
+			c2[l] = cx * cx + cy * cy + cz * cz;
+		}
+		float* k = out.curvature + first;
+		for (int l = 0; l < count; l++) {
+			k[l] = sqrtf(c2[l]) * inv[l] * inv[l];
+		}
+	}
+	return invalid;
+}
+
+// Answers count queries (curve[i], segment[i], t[i]), t clamped to [0, 1], with the positions,
+// derivatives and curvature of the prepared curves. Returns how many named a curve or segment
+// that does not exist; their outputs are NaN. Large batches run on the worker pool.
+int query_curves(const CurveQuerySet& set, const int* curve, const int* segment, const float* t, int count, const CurveQueryResult& out) {
+	auto run = [&](int begin, int end) {
+		int invalid = 0;
+		for (int first = begin; first < end; first += QUERY_BLOCK) {
+			invalid += query_block(set, curve, segment, t, first, std::min(QUERY_BLOCK, end - first), out);
+		}
+		return invalid;
+	};
+	if (count < PARALLEL_QUERY_MIN) {
+		return run(0, count);
+	}
+	std::atomic<int> invalid(0);
+	int tiles = (count + QUERY_TILE - 1) / QUERY_TILE;
+	parallel_for(tiles, [&](int i) {
+		invalid += run(i * QUERY_TILE, std::min(count, (i + 1) * QUERY_TILE));
+	});
+	return invalid.load();
+}
+
+#endif
@@ -0,0 +1,123 @@
+// Stand-in producer for the viewer's live control-point feed (p1 --feed name): moves the 10 points
+// of the main curve, or the points of a --surface-wave grid, through the shared-memory ring of
+// p1_feed.hpp. Start the viewer first, it creates the ring.
+//
+// usage: p1_feed [--rate updates_per_second | --flood] [--seconds s] [--surface rows cols] name
+//   The points circle around a ring of radius 2 (or ripple in z over the grid) at --rate updates
+//   per second, in bursts every millisecond. --flood pushes as fast as the ring takes them and
+//   reports the throughput. On Linux link with -lrt for shm_open on older C libraries.
+
+// Include standard headers
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+#define P1_FEED_IMPLEMENTATION
+#include "p1_feed.hpp"
+
+// GLOBAL VARIABLES
+double rate = 10000.0;		// updates per second
+double seconds = 10.0;
+bool flood = false;
+int surfaceRows = 0, surfaceCols = 0;	// > 0: drive the grid of --surface-wave rows cols
+
+// The update for point i at time t: the main curve's points circle on a wobbling ring, the grid
+// points keep the viewer's wave_surface layout and ripple in z
+FeedUpdate make_update(int i, double t) {
+	FeedUpdate u;
+	u.index = i;
+	if (surfaceRows > 0) {
+		int r = i / surfaceCols, c = i % surfaceCols;
+		float x = -3.0f + 6.0f * c / (surfaceCols - 1), y = -2.0f + 4.0f * r / (surfaceRows - 1);
+		u.target = FEED_SURFACE;
+		u.position[0] = x;
+		u.position[1] = y;
+		u.position[2] = 0.5f * (float)sin(2.0 * x - 3.0 * t) * (float)cos(1.5 * y + t);
+		return u;
+	}
+	double a = 6.2831853 * i / 10 + 0.5 * t;
+	double radius = 2.0 + 0.5 * sin(3.0 * t + i);
+	u.target = FEED_MAIN;
+	u.position[0] = (float)(radius * cos(a));
+	u.position[1] = (float)(0.75 * radius * sin(a));
+	u.position[2] = 0.0f;
+	return u;
+}
+
+int main(int argc, char** argv) {
+	const char* name = NULL;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--rate" && i + 1 < argc) {
+			rate = atof(argv[++i]);
+		}
+		else if (arg == "--flood") {
+			flood = true;
+		}
+		else if (arg == "--seconds" && i + 1 < argc) {
+			seconds = atof(argv[++i]);
+		}
+		else if (arg == "--surface" && i + 2 < argc) {
+			surfaceRows = atoi(argv[++i]);
+			surfaceCols = atoi(argv[++i]);
+		}
+		else if (arg.size() > 1 && arg[0] == '-') {
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 1;
+		}
+		else {
+			name = argv[i];
+		}
+	}
+	if (name == NULL || rate <= 0.0 || (surfaceRows > 0 && (surfaceRows < 2 || surfaceCols < 2))) {
+		fprintf(stderr, "usage: p1_feed [--rate updates_per_second | --flood] [--seconds s] [--surface rows cols] name\n");
+		return 1;
+	}
+
+	FeedMapping feed;
+	if (!open_feed(name, false, feed)) {
+		fprintf(stderr, "No feed %s: start the viewer with --feed %s first\n", name, name);
+		return 1;
+	}
+	int numPoints = (surfaceRows > 0) ? surfaceRows * surfaceCols : 10;
+
+	// one burst per millisecond, sized so the bursts add up to the rate; a flood fills whatever
+	// room the ring has and yields when it has none, so it counts nothing as dropped
+	FeedRing* ring = feed.ring;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now(), next = start;
+	long long sent = 0, dropped = 0, due = 0;
+	int point = 0;
+	double elapsed = 0.0;
+	while (elapsed < seconds) {
+		elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		long long target = (long long)(elapsed * rate);
+		if (flood) {
+			uint64_t room = FEED_CAPACITY - (ring->head.load(std::memory_order_relaxed) - ring->tail.load(std::memory_order_acquire));
+			target = due + (long long)std::min(room, (uint64_t)4096);
+			if (room == 0) {
+				std::this_thread::yield();
+			}
+		}
+		for (; due < target; due++) {
+			if (feed_push(ring, make_update(point, elapsed))) {
+				sent++;
+			}
+			else {
+				dropped++;
+			}
+			point = (point + 1) % numPoints;
+		}
+		if (!flood) {
+			next += std::chrono::milliseconds(1);
+			std::this_thread::sleep_until(next);
+		}
+	}
+	printf("%lld updates sent in %.2f s (%.0f per second), %lld dropped because the viewer fell a ring behind\n",
+		sent, elapsed, sent / elapsed, dropped);
+	close_feed(feed);
+	return 0;
+}
@@ -0,0 +1,153 @@
+// Live control-point feed shared by the viewer (p1_source.cpp, --feed name) and producers such as
+// p1_feed.cpp: a single-producer single-consumer ring of FeedUpdates in a named shared memory
+// block. The producer fills slots and publishes them by advancing head, the viewer reads the
+// published slots in place once per frame and hands them back by advancing tail. After mapping,
+// neither end makes a syscall per update. Exactly one translation unit of a program defines
+// P1_FEED_IMPLEMENTATION before including this file.
+#ifndef P1_FEED_HPP
+#define P1_FEED_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+const uint32_t FEED_MAGIC = 0x50314644;		// "P1FD"
+const uint32_t FEED_VERSION = 1;
+const uint32_t FEED_CAPACITY = 1 << 16;		// updates in flight, a power of two
+
+// What an update moves: a control point of the 10-point curve or of the surface grid
+enum { FEED_MAIN = 0, FEED_SURFACE = 1 };
+
+typedef struct FeedUpdate {
+	int32_t target;
+	int32_t index;
+	float position[3];
+};
+
+// head and tail count updates since the ring was created and sit on cache lines of their own,
+// so the two ends never write the same line. magic is set last by the creator.
+typedef struct FeedRing {
+	std::atomic<uint32_t> magic;
+	uint32_t version, capacity, updateSize;
+	alignas(64) std::atomic<uint64_t> head;		// written by the producer only
+	std::atomic<uint64_t> dropped;				// updates the producer found no room for
+	alignas(64) std::atomic<uint64_t> tail;		// written by the viewer only
+	alignas(64) FeedUpdate updates[FEED_CAPACITY];
+};
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the feed needs address-free 64-bit atomics");
+
+typedef struct FeedMapping {
+	FeedRing* ring;
+	void* handle;		// the file mapping on Windows
+	bool owner;			// created the block, so removes it when closing
+	char name[128];
+};
+
+bool open_feed(const char*, bool, FeedMapping&);
+void close_feed(FeedMapping&);
+bool feed_push(FeedRing*, const FeedUpdate&);
+
+#endif
+
+#ifdef P1_FEED_IMPLEMENTATION
+#undef P1_FEED_IMPLEMENTATION
+
+#include <stdio.h>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Maps the block called name (a POSIX shm name, "/" is prepended if missing). create makes it, or
+// resets one left behind by an earlier run; otherwise it has to exist and be initialized.
+bool open_feed(const char* name, bool create, FeedMapping& feed) {
+	feed.ring = NULL;
+	feed.handle = NULL;
+	feed.owner = create;
+	snprintf(feed.name, sizeof(feed.name), "%s%s", name[0] == '/' ? "" : "/", name);
+	size_t size = sizeof(FeedRing);
+#ifdef _WIN32
+	HANDLE mapping = create ? CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)size, feed.name + 1)
+		: OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, feed.name + 1);
+	if (mapping == NULL) {
+		return false;
+	}
+	void* base = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+	if (base == NULL) {
+		CloseHandle(mapping);
+		return false;
+	}
+	feed.handle = mapping;
+#else
+	int fd = shm_open(feed.name, create ? (O_CREAT | O_RDWR) : O_RDWR, 0600);
+	if (fd < 0) {
+		return false;
+	}
+	if (create && ftruncate(fd, (off_t)size) != 0) {
+		close(fd);
+		shm_unlink(feed.name);
+		return false;
+	}
+	void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);	// the mapping keeps the block
+	if (base == MAP_FAILED) {
+		return false;
+	}
+#endif
+	feed.ring = (FeedRing*)base;
+	FeedRing* ring = feed.ring;
+	if (create) {
+		ring->magic.store(0, std::memory_order_relaxed);
+		ring->version = FEED_VERSION;
+		ring->capacity = FEED_CAPACITY;
+		ring->updateSize = sizeof(FeedUpdate);
+		ring->head.store(0, std::memory_order_relaxed);
+		ring->dropped.store(0, std::memory_order_relaxed);
+		ring->tail.store(0, std::memory_order_relaxed);
+		ring->magic.store(FEED_MAGIC, std::memory_order_release);
+	}
+	else if (ring->magic.load(std::memory_order_acquire) != FEED_MAGIC || ring->version != FEED_VERSION ||
+		ring->capacity != FEED_CAPACITY || ring->updateSize != sizeof(FeedUpdate)) {
+		close_feed(feed);
+		return false;
+	}
+	return true;
+}
+
+void close_feed(FeedMapping& feed) {
+	if (feed.ring == NULL) {
+		return;
+	}
+#ifdef _WIN32
+	UnmapViewOfFile(feed.ring);
+	CloseHandle((HANDLE)feed.handle);
+#else
+	munmap(feed.ring, sizeof(FeedRing));
+	if (feed.owner) {
+		shm_unlink(feed.name);
+	}
+#endif
+	feed.ring = NULL;
+}
+
+// Producer side: copies u into the next slot and publishes it, or counts it as dropped when the
+// viewer is a whole ring behind. Never blocks.
+bool feed_push(FeedRing* ring, const FeedUpdate& u) {
+	uint64_t head = ring->head.load(std::memory_order_relaxed);
+	if (head - ring->tail.load(std::memory_order_acquire) >= FEED_CAPACITY) {
+		ring->dropped.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	ring->updates[head & (FEED_CAPACITY - 1)] = u;
+	ring->head.store(head + 1, std::memory_order_release);
+	return true;
+}
+
+#endif
@@ -0,0 +1,220 @@
+// Batch tessellator: control polygons in the curve document format in, sampled curves out, with
+// no window or GL context. It runs the viewer's own kernels through p1_curves.hpp.
+//
+// usage: p1_tess [--bspline d | --bezier | --catmull n | --fit tolerance] [--csv | --binary] [-o dir] [files... | -]
+//   A single input (- is stdin) is written to stdout unless -o is given. With -o every input
+//   becomes dir/<name>.csv, .bin or .txt; the files are spread over all cores.
+//
+// CSV is "curve,index,x,y,z" per vertex. Binary is "P1TS", int32 curve count, then per curve
+// int32 closed, int32 vertex count and count x 3 float32 (all in the host's byte order).
+// --fit goes the other way: every curve of the input is a dense stroke, and the output is a
+// curve document with the fewest B-spline control points per stroke within tolerance.
+
+// Include standard headers
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <chrono>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#define P1_CURVES_IMPLEMENTATION
+#include "p1_curves.hpp"
+
+typedef struct TessJob {
+	std::string input, output;	// "-" for stdin / stdout
+	int curves, vertices;
+	bool ok;
+};
+
+// Function prototypes
+bool tessellate_file(TessJob&);
+std::string output_path(const std::string&, const std::string&);
+
+// GLOBAL VARIABLES
+int scheme = TESS_BSPLINE;
+int param = 3;		// subdivision depth or Catmull-Rom samples per segment
+bool binary = false;
+float fitTolerance = 0.0f;	// > 0: fit B-splines instead of tessellating
+
+// Reads one input, tessellates every curve in it and writes the result. Runs as a pool task;
+// the subdivision kernels it calls then run inline on the same thread.
+bool tessellate_file(TessJob& job) {
+	job.curves = job.vertices = 0;
+	FILE* in = (job.input == "-") ? stdin : fopen(job.input.c_str(), "r");
+	if (in == NULL) {
+		fprintf(stderr, "Could not open %s\n", job.input.c_str());
+		return false;
+	}
+	std::vector<point> points;
+	std::vector<int> start;
+	std::vector<char> closed;
+	read_curves(in, points, start, closed);
+	if (in != stdin) {
+		fclose(in);
+	}
+
+	bool fit = (fitTolerance > 0.0f);
+	FILE* out = (job.output == "-") ? stdout : fopen(job.output.c_str(), (binary && !fit) ? "wb" : "w");
+	if (out == NULL) {
+		fprintf(stderr, "Could not open %s for writing\n", job.output.c_str());
+		return false;
+	}
+	int numCurves = (int)start.size() - 1;
+	if (fit) {
+		std::vector<point> controlPoints;
+		for (int c = 0; c < numCurves; c++) {
+			fit_bspline_tolerance(&points[start[c]], start[c + 1] - start[c], closed[c] != 0, fitTolerance, controlPoints);
+			fprintf(out, "curve %s\n", closed[c] ? "closed" : "open");
+			for (size_t i = 0; i < controlPoints.size(); i++) {
+				fprintf(out, "%.9g %.9g %.9g\n", controlPoints[i].x, controlPoints[i].y, controlPoints[i].z);
+			}
+			job.curves++;
+			job.vertices += (int)controlPoints.size();
+		}
+		numCurves = 0;
+	}
+	else if (binary) {
+		int32_t header = numCurves;
+		fwrite("P1TS", 1, 4, out);
+		fwrite(&header, sizeof(header), 1, out);
+	}
+
+	std::vector<point> scratch[2];
+	std::vector<Vertex> vertices;
+	std::vector<float> xyz;
+	float white[] = { 1.0f, 1.0f, 1.0f, 1.0f };
+	for (int c = 0; c < numCurves; c++) {
+		int n = start[c + 1] - start[c];
+		int count = tessellated_count(n, closed[c] != 0, scheme, param);
+		vertices.resize(count);
+		tessellate_curve(&points[start[c]], n, closed[c] != 0, scheme, param, scratch, vertices.data(), white);
+		if (binary) {
+			int32_t header[2] = { closed[c], count };
+			xyz.resize(3 * count);
+			for (int i = 0; i < count; i++) {
+				xyz[3 * i] = vertices[i].Position[0];
+				xyz[3 * i + 1] = vertices[i].Position[1];
+				xyz[3 * i + 2] = vertices[i].Position[2];
+			}
+			fwrite(header, sizeof(header), 1, out);
+			fwrite(xyz.data(), sizeof(float), xyz.size(), out);
+		}
+		else {
+			for (int i = 0; i < count; i++) {
+				fprintf(out, "%d,%d,%.9g,%.9g,%.9g\n", c, i, vertices[i].Position[0], vertices[i].Position[1], vertices[i].Position[2]);
+			}
+		}
+		job.curves++;
+		job.vertices += count;
+	}
+
+	bool ok = !ferror(out);
+	if (out != stdout) {
+		ok = (fclose(out) == 0) && ok;
+	}
+	else {
+		ok = (fflush(out) == 0) && ok;
+	}
+	if (!ok) {
+		fprintf(stderr, "Writing %s failed\n", job.output.c_str());
+	}
+	return ok;
+}
+
+// dir/<input name without directory and extension>.csv|.bin|.txt
+std::string output_path(const std::string& dir, const std::string& input) {
+	std::string name = (input == "-") ? "stdin" : input;
+	size_t slash = name.find_last_of("/\\");
+	if (slash != std::string::npos) {
+		name = name.substr(slash + 1);
+	}
+	size_t dot = name.find_last_of('.');
+	if (dot != std::string::npos && dot > 0) {
+		name = name.substr(0, dot);
+	}
+	return dir + "/" + name + ((fitTolerance > 0.0f) ? ".txt" : binary ? ".bin" : ".csv");
+}
+
+int main(int argc, char** argv) {
+	std::vector<std::string> inputs;
+	const char* outputDir = NULL;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--bspline" && i + 1 < argc) {
+			scheme = TESS_BSPLINE;
+			param = atoi(argv[++i]);
+		}
+		else if (arg == "--catmull" && i + 1 < argc) {
+			scheme = TESS_CATMULL_ROM;
+			param = atoi(argv[++i]);
+		}
+		else if (arg == "--fit" && i + 1 < argc) {
+			fitTolerance = (float)atof(argv[++i]);
+		}
+		else if (arg == "--bezier") {
+			scheme = TESS_BEZIER;
+		}
+		else if (arg == "--csv") {
+			binary = false;
+		}
+		else if (arg == "--binary") {
+			binary = true;
+		}
+		else if (arg == "-o" && i + 1 < argc) {
+			outputDir = argv[++i];
+		}
+		else if (arg.size() > 1 && arg[0] == '-' && arg != "-") {
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 1;
+		}
+		else {
+			inputs.push_back(arg);
+		}
+	}
+	if ((scheme == TESS_BSPLINE && (param < 0 || param > 20)) || (scheme == TESS_CATMULL_ROM && param < 1)) {
+		fprintf(stderr, "need 0 <= depth <= 20 and at least 1 sample per segment\n");
+		return 1;
+	}
+	if (inputs.empty()) {
+		inputs.push_back("-");
+	}
+	if (outputDir == NULL && inputs.size() > 1) {
+		fprintf(stderr, "several inputs need an output directory (-o dir)\n");
+		return 1;
+	}
+
+	std::vector<TessJob> jobs(inputs.size());
+	for (size_t i = 0; i < inputs.size(); i++) {
+		jobs[i].input = inputs[i];
+		jobs[i].output = (outputDir != NULL) ? output_path(outputDir, inputs[i]) : "-";
+	}
+#ifdef _WIN32
+	if (binary && fitTolerance == 0.0f) {
+		_setmode(_fileno(stdout), _O_BINARY);
+	}
+#endif
+
+	// one task per file, handed out as workers free up
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	parallel_for((int)jobs.size(), [&](int i) {
+		jobs[i].ok = tessellate_file(jobs[i]);
+	});
+	double ms = 1000.0 * std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	stop_workers();
+
+	int failed = 0, curves = 0;
+	long long vertices = 0;
+	for (size_t i = 0; i < jobs.size(); i++) {
+		failed += jobs[i].ok ? 0 : 1;
+		curves += jobs[i].curves;
+		vertices += jobs[i].vertices;
+	}
+	fprintf(stderr, "%d files, %d curves, %lld vertices in %.1f ms%s\n", (int)jobs.size(), curves, vertices, ms,
+		failed ? " (some failed)" : "");
+	return failed ? 1 : 0;
+}